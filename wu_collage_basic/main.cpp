@@ -13,12 +13,31 @@
 
 int main(int argc, const char * argv[])
 {
+  // Worker mode of sharded rendering: wu_collage_basic --shard job_file
+  if ((argc == 3) && (std::string(argv[1]) == "--shard")) {
+    return CollageBasic::RenderCollageShard(argv[2]) ? 0 : -1;
+  }
   std::cout << "Well come to \"Collage Basic\"" << std::endl << std::endl;
 
-  if (argc != 2) {
+  // Usage: wu_collage_basic image_list [--deep-zoom] [--shards shard_num]
+  if (argc < 2) {
     std::cout << "Error number of input arguments" << std::endl;
     return 0;
   }
+  bool deep_zoom = false;
+  int shard_num = 0;
+  for (int i = 2; i < argc; ++i) {
+    if (std::string(argv[i]) == "--deep-zoom") {
+      deep_zoom = true;
+    } else if ((std::string(argv[i]) == "--shards") && (i + 1 < argc) &&
+               (atoi(argv[i + 1]) > 0)) {
+      shard_num = atoi(argv[i + 1]);
+      ++i;
+    } else {
+      std::cout << "Error input argument: " << argv[i] << std::endl;
+      return 0;
+    }
+  }
   std::string image_list(argv[1]);
   int canvas_width = 0;
   while ((canvas_width < 100) || (canvas_width > 2000)) {
@@ -42,7 +61,6 @@ int main(int argc, const char * argv[])
   }
   end = clock();
   
-  cv::Mat canvas = my_collage.OutputCollageImage();
   int canvas_height = my_collage.canvas_height();
   float canvas_alpha = my_collage.canvas_alpha();
   std::cout << "canvas_height: " << canvas_height << std::endl;
@@ -51,6 +69,38 @@ int main(int argc, const char * argv[])
             << " us (10e-6 s)" << std::endl;
   std::string html_save_path = "/tmp/collage_result.html";
   my_collage.OutputCollageHtml(html_save_path);
+  if (deep_zoom) {
+    // Serve deep-zoom tiles on demand, one "level col row" request per line.
+    // The tile file is written before its path is echoed back.
+    std::string dzi_save_path = "/tmp/collage_result.dzi";
+    std::string tiles_dir = "/tmp/collage_result_files";
+    if (!my_collage.OutputCollageDzi(dzi_save_path)) {
+      return -1;
+    }
+    std::cout << "deep zoom: " << dzi_save_path << " (max level "
+              << my_collage.tile_max_level() << ")" << std::endl;
+    int level, tile_col, tile_row;
+    while (std::cin >> level >> tile_col >> tile_row) {
+      if (my_collage.OutputCollageTileFile(level, tile_col, tile_row,
+                                           tiles_dir)) {
+        std::cout << tiles_dir << "/" << level << "/" << tile_col << "_"
+                  << tile_row << ".jpg" << std::endl;
+      } else {
+        std::cout << "no tile" << std::endl;
+      }
+    }
+    return 0;
+  }
+  if (shard_num > 0) {
+    // Render the full canvas with shard_num worker processes.
+    std::string ppm_save_path = "/tmp/collage_result.ppm";
+    if (!my_collage.OutputCollageImageSharded(ppm_save_path, shard_num)) {
+      return -1;
+    }
+    std::cout << "sharded result: " << ppm_save_path << std::endl;
+    return 0;
+  }
+  cv::Mat canvas = my_collage.OutputCollageImage();
   cv::imshow("Collage", canvas);
   cv::waitKey();
   
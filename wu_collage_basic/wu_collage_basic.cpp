@@ -8,8 +8,25 @@
 
 #include "wu_collage_basic.h"
 #include <math.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__APPLE__)
+#include <mach-o/dyld.h>
+#endif
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
+
+extern char** environ;
 
 CollageBasic::CollageBasic(std::vector<std::string> input_image_list,
                            int canvas_width) {
@@ -27,6 +44,9 @@ CollageBasic::CollageBasic(std::vector<std::string> input_image_list,
   image_num_ = static_cast<int>(input_image_list.size());
   srand(static_cast<unsigned>(time(0)));
   tree_root_ = new TreeNode();
+  tile_index_cols_ = 0;
+  tile_index_rows_ = 0;
+  tile_size_ = DEEP_ZOOM_TILE_SIZE;
 }
 
 // Private member functions:
@@ -76,25 +96,35 @@ int CollageBasic::CreateCollage(float expect_alpha, float thresh) {
   tree_root_->alpha_expect_ = expect_alpha;
   float lower_bound = expect_alpha / thresh;
   float upper_bound = expect_alpha * thresh;
-  int total_iter_counter = 1;
+  int total_iter_counter = 0;
   
-  // Do the initial tree generatio and calculation.
   // A: generate a full balanced binary tree with image_num_ leaves.
+  // The tree shape only depends on image_num_, so we keep it and try random
+  // split types and image dispatch, ALPHA_LANE_NUM candidates at a time.
   GenerateInitialTree();
-  // B: recursively calculate aspect ratio.
-  canvas_alpha_ = CalculateAlpha(tree_root_);
-  
-  while ((canvas_alpha_ < lower_bound) || (canvas_alpha_ > upper_bound)) {
-    GenerateInitialTree();
-    canvas_alpha_ = CalculateAlpha(tree_root_);
-    ++total_iter_counter;
-    if (total_iter_counter > MAX_TREE_GENE_NUM) {
+  AlphaBatchEvaluator evaluator(tree_root_, tree_leaves_, image_alpha_vec_);
+  int pass_lane = -1;
+  while (pass_lane == -1) {
+    if (total_iter_counter >= MAX_TREE_GENE_NUM) {
       std::cout << "*******************************" << std::endl;
       std::cout << "max iteration number reached..." << std::endl;
       std::cout << "*******************************" << std::endl;
       return -1;
     }
+    evaluator.RandomCandidates();
+    unsigned pass_mask = evaluator.Evaluate(lower_bound, upper_bound);
+    for (int lane = 0; lane < ALPHA_LANE_NUM; ++lane) {
+      ++total_iter_counter;
+      if (pass_mask & (1u << lane)) {
+        pass_lane = lane;
+        break;
+      }
+    }
   }
+  // B: write the passing candidate into the tree and calculate aspect ratio
+  // for all the tree nodes.
+  evaluator.Materialize(pass_lane);
+  canvas_alpha_ = CalculateAlpha(tree_root_);
   // std::cout << "Canvas generation success!" << std::endl;
   std::cout << "Total iteration number is: " << total_iter_counter << std::endl;
   // After adjustment, set the position for all the tile images.
@@ -174,6 +204,316 @@ bool CollageBasic::OutputCollageHtml(const std::string output_html_path) {
   return true;
 }
 
+// After calling CreateCollage(), call this function to save result collage to a
+// binary PPM file specified by output_ppm_path. The work is shared by
+// shard_num worker processes.
+bool CollageBasic::OutputCollageImageSharded(const std::string output_ppm_path,
+                                             int shard_num,
+                                             const std::string worker_path) const {
+  assert(canvas_alpha_ != -1);
+  assert(canvas_width_ != -1);
+  assert(shard_num > 0);
+  // Step 1: create the output file with its final size, so that the workers
+  // can write their rows at fixed offsets.
+  std::ostringstream header;
+  header << "P6\n" << canvas_width_ << " " << canvas_height_ << "\n255\n";
+  std::string header_str = header.str();
+  int fd = open(output_ppm_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cout << "Error: OutputCollageImageSharded 1" << std::endl;
+    return false;
+  }
+  off_t file_size = static_cast<off_t>(header_str.size()) +
+      static_cast<off_t>(canvas_width_) * canvas_height_ * 3;
+  bool success = (write(fd, header_str.c_str(), header_str.size()) ==
+                  static_cast<ssize_t>(header_str.size())) &&
+                 (ftruncate(fd, file_size) == 0);
+  close(fd);
+  if (!success) {
+    std::cout << "Error: OutputCollageImageSharded 2" << std::endl;
+    return false;
+  }
+  
+  // Step 2: write one job file for each shard.
+  std::vector<TreeNode*> shards;
+  std::vector<cv::Rect> regions;
+  SplitShards(shard_num, &shards, &regions);
+  std::vector<std::string> job_paths;
+  for (int i = 0; i < shards.size(); ++i) {
+    std::ostringstream job_path;
+    job_path << output_ppm_path << ".shard" << i;
+    std::ofstream job(job_path.str().c_str());
+    if (!job) {
+      std::cout << "Error: OutputCollageImageSharded 3" << std::endl;
+      success = false;
+      break;
+    }
+    job_paths.push_back(job_path.str());
+    job << "output " << output_ppm_path << "\n";
+    job << "canvas " << canvas_width_ << " " << canvas_height_ << "\n";
+    job << "header " << header_str.size() << "\n";
+    job << "region " << regions[i].x << " " << regions[i].y << " "
+        << regions[i].x + regions[i].width << " "
+        << regions[i].y + regions[i].height << "\n";
+    // Leaf positions are truncated the same way as in OutputCollageImage().
+    std::vector<TreeNode*> node_stack(1, shards[i]);
+    while (!node_stack.empty()) {
+      TreeNode* node = node_stack.back();
+      node_stack.pop_back();
+      if (!node->is_leaf_) {
+        node_stack.push_back(node->right_child_);
+        node_stack.push_back(node->left_child_);
+        continue;
+      }
+      cv::Rect pos_cv(node->position_.x_, node->position_.y_,
+                      node->position_.width_, node->position_.height_);
+      job << "tile " << pos_cv.x << " " << pos_cv.y << " " << pos_cv.width
+          << " " << pos_cv.height << " "
+          << image_path_vec_[node->image_index_] << "\n";
+    }
+    job.close();
+  }
+  
+  // Step 3: start one worker process per shard and wait for all of them.
+  // Workers are new executables instead of plain forks, since a forked child
+  // may deadlock in OpenCV if our process has used its thread pool before.
+  std::string worker = worker_path;
+  if (worker.empty()) {
+    char exe_path[4096];
+#if defined(__APPLE__)
+    uint32_t exe_size = sizeof(exe_path);
+    if (_NSGetExecutablePath(exe_path, &exe_size) == 0) worker = exe_path;
+#else
+    ssize_t exe_size = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (exe_size > 0) worker = std::string(exe_path, exe_size);
+#endif
+  }
+  std::vector<pid_t> workers;
+  for (int i = 0; success && (i < job_paths.size()); ++i) {
+    pid_t pid = 0;
+    char* worker_argv[] = {const_cast<char*>(worker.c_str()),
+                           const_cast<char*>("--shard"),
+                           const_cast<char*>(job_paths[i].c_str()), NULL};
+    if (!worker.empty() &&
+        (posix_spawn(&pid, worker.c_str(), NULL, NULL, worker_argv,
+                     environ) == 0)) {
+      workers.push_back(pid);
+    } else {
+      // Cannot start a worker, render this shard ourselves.
+      success = RenderCollageShard(job_paths[i]);
+    }
+  }
+  for (int i = 0; i < workers.size(); ++i) {
+    int status = 0;
+    if ((waitpid(workers[i], &status, 0) != workers[i]) ||
+        !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+      std::cout << "Error: OutputCollageImageSharded 4" << std::endl;
+      success = false;
+    }
+  }
+  for (int i = 0; i < job_paths.size(); ++i) {
+    remove(job_paths[i].c_str());
+  }
+  return success;
+}
+
+// Read a shard job file written by OutputCollageImageSharded(), paste the tile
+// images of the shard region and write the region rows into the output file.
+bool CollageBasic::RenderCollageShard(const std::string shard_job_path) {
+  std::ifstream job(shard_job_path.c_str());
+  if (!job) {
+    std::cout << "Error: RenderCollageShard 1" << std::endl;
+    return false;
+  }
+  std::string output_path;
+  int canvas_width = 0;
+  int canvas_height = 0;
+  long header_size = 0;
+  cv::Rect region_rect;
+  cv::Mat region;
+  std::string key;
+  while (job >> key) {
+    if (key == "output") {
+      job >> std::ws;
+      std::getline(job, output_path);
+    } else if (key == "canvas") {
+      job >> canvas_width >> canvas_height;
+    } else if (key == "header") {
+      job >> header_size;
+    } else if (key == "region") {
+      int x0, y0, x1, y1;
+      job >> x0 >> y0 >> x1 >> y1;
+      region_rect = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+      region = cv::Mat::zeros(region_rect.size(), CV_8UC3);
+    } else if (key == "tile") {
+      cv::Rect tile_rect;
+      std::string img_path;
+      job >> tile_rect.x >> tile_rect.y >> tile_rect.width >> tile_rect.height;
+      job >> std::ws;
+      std::getline(job, img_path);
+      cv::Rect clip_rect = tile_rect & region_rect;
+      if (region.empty() || (clip_rect.area() == 0)) continue;
+      cv::Mat img = cv::imread(img_path.c_str());
+      if (img.empty()) {
+        std::cout << "Error: RenderCollageShard 2" << std::endl;
+        return false;
+      }
+      assert(img.type() == CV_8UC3);
+      cv::Mat resized_img(tile_rect.height, tile_rect.width, img.type());
+      cv::resize(img, resized_img, resized_img.size());
+      cv::Mat src(resized_img, cv::Rect(clip_rect.x - tile_rect.x,
+                                        clip_rect.y - tile_rect.y,
+                                        clip_rect.width, clip_rect.height));
+      cv::Mat roi(region, cv::Rect(clip_rect.x - region_rect.x,
+                                   clip_rect.y - region_rect.y,
+                                   clip_rect.width, clip_rect.height));
+      src.copyTo(roi);
+    } else {
+      std::cout << "Error: RenderCollageShard 3" << std::endl;
+      return false;
+    }
+  }
+  job.close();
+  if (output_path.empty() || (canvas_width <= 0)) {
+    std::cout << "Error: RenderCollageShard 4" << std::endl;
+    return false;
+  }
+  if (region.empty()) return true;
+  
+  // PPM stores RGB rows, one after another.
+  cv::Mat region_rgb;
+  cv::cvtColor(region, region_rgb, cv::COLOR_BGR2RGB);
+  int fd = open(output_path.c_str(), O_WRONLY);
+  if (fd < 0) {
+    std::cout << "Error: RenderCollageShard 5" << std::endl;
+    return false;
+  }
+  ssize_t row_bytes = static_cast<ssize_t>(region_rect.width) * 3;
+  for (int row = 0; row < region_rgb.rows; ++row) {
+    off_t offset = header_size +
+        (static_cast<off_t>(region_rect.y + row) * canvas_width +
+         region_rect.x) * 3;
+    if (pwrite(fd, region_rgb.ptr(row), row_bytes, offset) != row_bytes) {
+      std::cout << "Error: RenderCollageShard 6" << std::endl;
+      close(fd);
+      return false;
+    }
+  }
+  close(fd);
+  return true;
+}
+
+// After calling CreateCollage(), call this function to render one tile of the
+// deep-zoom pyramid. Tile (tile_col, tile_row) covers pixels
+// [tile_col * tile_size_, (tile_col + 1) * tile_size_) of the level, the tiles
+// at the right and bottom border may be smaller.
+cv::Mat CollageBasic::OutputCollageTile(int level, int tile_col, int tile_row) {
+  assert(canvas_alpha_ != -1);
+  assert(canvas_width_ != -1);
+  int tile_size = tile_size_;
+  assert(tile_size > 0);
+  int max_level = tile_max_level();
+  if ((level < 0) || (level > max_level) || (tile_col < 0) || (tile_row < 0)) {
+    std::cout << "Error: OutputCollageTile" << std::endl;
+    return cv::Mat();
+  }
+  // Size of the canvas at this level.
+  float scale = 1.0f / (1 << (max_level - level));
+  int level_width = static_cast<int>(ceil(canvas_width_ * scale));
+  int level_height = static_cast<int>(ceil(canvas_height_ * scale));
+  cv::Rect tile_rect(tile_col * tile_size, tile_row * tile_size,
+                     tile_size, tile_size);
+  tile_rect &= cv::Rect(0, 0, level_width, level_height);
+  if (tile_rect.area() == 0) return cv::Mat();
+  assert(image_vec_[0].type() == CV_8UC3);
+  cv::Mat tile = cv::Mat::zeros(tile_rect.size(), image_vec_[0].type());
+  
+  // Only visit the images which intersect with the tile.
+  FloatRect query;
+  query.x_ = tile_rect.x / scale;
+  query.y_ = tile_rect.y / scale;
+  query.width_ = tile_rect.width / scale;
+  query.height_ = tile_rect.height / scale;
+  std::vector<int> leaf_inds;
+  {
+    std::lock_guard<std::mutex> lock(tile_cache_mutex_);
+    if (tile_index_grid_.empty()) BuildTileIndex();
+    QueryTileIndex(query, &leaf_inds);
+  }
+  for (int i = 0; i < leaf_inds.size(); ++i) {
+    TreeNode* leaf = tree_leaves_[leaf_inds[i]];
+    FloatRect pos = leaf->position_;
+    // Position of the image at this level. Neighbouring images share their
+    // rounded edges, so that there are no seams between them.
+    int x0 = cvRound(pos.x_ * scale);
+    int y0 = cvRound(pos.y_ * scale);
+    int x1 = cvRound((pos.x_ + pos.width_) * scale);
+    int y1 = cvRound((pos.y_ + pos.height_) * scale);
+    cv::Rect img_rect(x0, y0, x1 - x0, y1 - y0);
+    cv::Rect roi_rect = img_rect & tile_rect;
+    if (roi_rect.area() == 0) continue;
+    // Sample the visible part of the image from the pyramid level matching
+    // the resolution we need. Pixel centers are aligned.
+    cv::Mat src = PyramidImage(leaf->image_index_,
+                               img_rect.width, img_rect.height);
+    double sx = static_cast<double>(img_rect.width) / src.cols;
+    double sy = static_cast<double>(img_rect.height) / src.rows;
+    cv::Mat affine = (cv::Mat_<double>(2, 3) <<
+        sx, 0, img_rect.x - roi_rect.x + 0.5 * sx - 0.5,
+        0, sy, img_rect.y - roi_rect.y + 0.5 * sy - 0.5);
+    cv::Mat roi(tile, cv::Rect(roi_rect.x - tile_rect.x,
+                               roi_rect.y - tile_rect.y,
+                               roi_rect.width, roi_rect.height));
+    cv::warpAffine(src, roi, affine, roi.size(), cv::INTER_LINEAR,
+                   cv::BORDER_REPLICATE);
+  }
+  return tile;
+}
+
+// Call this function when the viewer asks for a tile, the tile is rendered by
+// OutputCollageTile() and saved in the deep-zoom directory layout.
+bool CollageBasic::OutputCollageTileFile(int level, int tile_col, int tile_row,
+                                         const std::string tiles_dir) {
+  cv::Mat tile = OutputCollageTile(level, tile_col, tile_row);
+  if (tile.empty()) return false;
+  std::ostringstream level_dir;
+  level_dir << tiles_dir << "/" << level;
+  // The directories may exist already.
+  mkdir(tiles_dir.c_str(), 0755);
+  mkdir(level_dir.str().c_str(), 0755);
+  std::ostringstream tile_path;
+  tile_path << level_dir.str() << "/" << tile_col << "_" << tile_row << ".jpg";
+  if (!cv::imwrite(tile_path.str(), tile)) {
+    std::cout << "Error: OutputCollageTileFile" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// After calling CreateCollage(), call this function to save the deep-zoom
+// descriptor to a .dzi file specified by output_dzi_path.
+bool CollageBasic::OutputCollageDzi(const std::string output_dzi_path,
+                                    int tile_size) {
+  assert(canvas_alpha_ != -1);
+  assert(canvas_width_ != -1);
+  assert(tile_size > 0);
+  tile_size_ = tile_size;
+  std::ofstream output_dzi(output_dzi_path.c_str());
+  if (!output_dzi) {
+    std::cout << "Error: OutputCollageDzi" << std::endl;
+    return false;
+  }
+  output_dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  output_dzi << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n";
+  output_dzi << "\tTileSize=\"" << tile_size << "\" Overlap=\"0\" ";
+  output_dzi << "Format=\"jpg\">\n";
+  output_dzi << "\t<Size Width=\"" << canvas_width_ << "\" Height=\"";
+  output_dzi << canvas_height_ << "\"/>\n";
+  output_dzi << "</Image>";
+  output_dzi.close();
+  return true;
+}
+
 // Private member functions:
 // The images are stored in the image list, one image path per row.
 // This function reads the images into image_vec_ and their aspect
@@ -202,6 +542,7 @@ bool CollageBasic::ReadImageList(std::string input_image_list) {
 // Generate an initial full binary tree with image_num_ leaves.
 bool CollageBasic::GenerateInitialTree() {
   tree_leaves_.clear();
+  tile_index_grid_.clear();
   if (tree_root_ != NULL) ReleaseTree(tree_root_);
   tree_root_ = new TreeNode();
   // Step 1: create a (k-1)-depth binary tree with max nodes.
@@ -460,6 +801,348 @@ void CollageBasic::RandomSplitType(TreeNode* node) {
   RandomSplitType(node->right_child_);
 }
 
+// Start from the whole tree, and keep replacing the largest inner node in
+// shards by its two children, until we have shard_num shards.
+// Both children get their region from the same cut, truncated like the leaf
+// rects in OutputCollageImage(), so that neighbouring regions share their
+// edges exactly. Do not round here, or the shards lose edge columns and rows.
+void CollageBasic::SplitShards(int shard_num, std::vector<TreeNode*>* shards,
+                               std::vector<cv::Rect>* regions) const {
+  shards->clear();
+  regions->clear();
+  shards->push_back(tree_root_);
+  regions->push_back(cv::Rect(0, 0, canvas_width_, canvas_height_));
+  while (shards->size() < shard_num) {
+    int largest = -1;
+    // Print size canvases overflow int areas.
+    long long largest_area = 0;
+    for (int i = 0; i < shards->size(); ++i) {
+      long long area = static_cast<long long>((*regions)[i].width) *
+                       (*regions)[i].height;
+      if (!(*shards)[i]->is_leaf_ && ((largest == -1) || (area > largest_area))) {
+        largest = i;
+        largest_area = area;
+      }
+    }
+    // All the shards are leaves, we cannot split any more.
+    if (largest == -1) break;
+    TreeNode* node = (*shards)[largest];
+    cv::Rect region = (*regions)[largest];
+    cv::Rect left_region = region;
+    cv::Rect right_region = region;
+    FloatRect left_pos = node->left_child_->position_;
+    if (node->split_type_ == 'v') {
+      int cut = static_cast<int>(left_pos.x_ + left_pos.width_);
+      cut = std::min(std::max(cut, region.x), region.x + region.width);
+      left_region.width = cut - region.x;
+      right_region.x = cut;
+      right_region.width = region.x + region.width - cut;
+    } else {
+      int cut = static_cast<int>(left_pos.y_ + left_pos.height_);
+      cut = std::min(std::max(cut, region.y), region.y + region.height);
+      left_region.height = cut - region.y;
+      right_region.y = cut;
+      right_region.height = region.y + region.height - cut;
+    }
+    (*shards)[largest] = node->left_child_;
+    (*regions)[largest] = left_region;
+    shards->push_back(node->right_child_);
+    regions->push_back(right_region);
+  }
+}
+
+// Build a uniform grid over the canvas with about image_num_ cells. Each leaf
+// is registered in all the cells its position covers.
+void CollageBasic::BuildTileIndex() {
+  float cell_num = static_cast<float>(image_num_);
+  tile_index_cols_ = std::max(1, static_cast<int>(sqrt(cell_num * canvas_alpha_)));
+  tile_index_rows_ = std::max(1, static_cast<int>(sqrt(cell_num / canvas_alpha_)));
+  tile_index_grid_.clear();
+  tile_index_grid_.resize(tile_index_cols_ * tile_index_rows_);
+  float cell_width = static_cast<float>(canvas_width_) / tile_index_cols_;
+  float cell_height = static_cast<float>(canvas_height_) / tile_index_rows_;
+  for (int i = 0; i < image_num_; ++i) {
+    FloatRect pos = tree_leaves_[i]->position_;
+    int col0 = std::max(0, static_cast<int>(pos.x_ / cell_width));
+    int row0 = std::max(0, static_cast<int>(pos.y_ / cell_height));
+    int col1 = std::min(tile_index_cols_ - 1,
+                        static_cast<int>((pos.x_ + pos.width_) / cell_width));
+    int row1 = std::min(tile_index_rows_ - 1,
+                        static_cast<int>((pos.y_ + pos.height_) / cell_height));
+    for (int row = row0; row <= row1; ++row) {
+      for (int col = col0; col <= col1; ++col) {
+        tile_index_grid_[row * tile_index_cols_ + col].push_back(i);
+      }
+    }
+  }
+}
+
+// Collect the leaves from the grid cells covered by rect, then drop the ones
+// which do not really intersect with rect.
+void CollageBasic::QueryTileIndex(const FloatRect& rect,
+                                  std::vector<int>* leaf_inds) {
+  leaf_inds->clear();
+  float cell_width = static_cast<float>(canvas_width_) / tile_index_cols_;
+  float cell_height = static_cast<float>(canvas_height_) / tile_index_rows_;
+  int col0 = std::max(0, static_cast<int>(rect.x_ / cell_width));
+  int row0 = std::max(0, static_cast<int>(rect.y_ / cell_height));
+  int col1 = std::min(tile_index_cols_ - 1,
+                      static_cast<int>((rect.x_ + rect.width_) / cell_width));
+  int row1 = std::min(tile_index_rows_ - 1,
+                      static_cast<int>((rect.y_ + rect.height_) / cell_height));
+  for (int row = row0; row <= row1; ++row) {
+    for (int col = col0; col <= col1; ++col) {
+      const std::vector<int>& cell = tile_index_grid_[row * tile_index_cols_ + col];
+      leaf_inds->insert(leaf_inds->end(), cell.begin(), cell.end());
+    }
+  }
+  // A leaf covering several cells is found several times.
+  std::sort(leaf_inds->begin(), leaf_inds->end());
+  leaf_inds->erase(std::unique(leaf_inds->begin(), leaf_inds->end()),
+                   leaf_inds->end());
+  int counter = 0;
+  for (int i = 0; i < leaf_inds->size(); ++i) {
+    FloatRect pos = tree_leaves_[(*leaf_inds)[i]]->position_;
+    if ((pos.x_ < rect.x_ + rect.width_) && (rect.x_ < pos.x_ + pos.width_) &&
+        (pos.y_ < rect.y_ + rect.height_) && (rect.y_ < pos.y_ + pos.height_)) {
+      (*leaf_inds)[counter] = (*leaf_inds)[i];
+      ++counter;
+    }
+  }
+  leaf_inds->resize(counter);
+}
+
+// Level 0 of the pyramid is the input image itself. We only go down while
+// the next level is still large enough, so that no detail is lost.
+// The returned header shares the data with the cached level.
+cv::Mat CollageBasic::PyramidImage(int img_ind, int width, int height) {
+  std::lock_guard<std::mutex> lock(tile_cache_mutex_);
+  if (image_pyramid_vec_.size() != image_vec_.size())
+    image_pyramid_vec_.resize(image_vec_.size());
+  std::vector<cv::Mat>& pyramid = image_pyramid_vec_[img_ind];
+  if (pyramid.empty()) pyramid.push_back(image_vec_[img_ind]);
+  int level = 0;
+  while (true) {
+    cv::Mat current = pyramid[level];
+    if (((current.cols + 1) / 2 < width) || ((current.rows + 1) / 2 < height))
+      break;
+    if (level + 1 == pyramid.size()) {
+      cv::Mat next;
+      cv::pyrDown(current, next);
+      pyramid.push_back(next);
+    }
+    ++level;
+  }
+  return pyramid[level];
+}
+
+// SIMD kernels of AlphaBatchEvaluator. The AVX-512 and AVX2 versions are
+// compiled for their instruction set only, and picked at runtime.
+// Same calculation as CalculateAlpha(), 'v': l + r, 'h': l * r / (l + r).
+static void AlphaKernelScalar(float* node_alpha, const int* left_id,
+                              const int* right_id, const unsigned* split_mask,
+                              int leaf_num, int inner_num) {
+  for (int i = 0; i < inner_num; ++i) {
+    const float* left = node_alpha + left_id[i] * ALPHA_LANE_NUM;
+    const float* right = node_alpha + right_id[i] * ALPHA_LANE_NUM;
+    float* result = node_alpha + (leaf_num + i) * ALPHA_LANE_NUM;
+    for (int lane = 0; lane < ALPHA_LANE_NUM; ++lane) {
+      float v_alpha = left[lane] + right[lane];
+      float h_alpha = (left[lane] * right[lane]) / v_alpha;
+      result[lane] = ((split_mask[i] >> lane) & 1) ? v_alpha : h_alpha;
+    }
+  }
+}
+
+static void RandomKernelScalar(unsigned* random_state) {
+  for (int lane = 0; lane < ALPHA_LANE_NUM; ++lane) {
+    unsigned x = random_state[lane];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state[lane] = x;
+  }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define ALPHA_KERNEL_X86 1
+__attribute__((target("avx2")))
+static void AlphaKernelAvx2(float* node_alpha, const int* left_id,
+                            const int* right_id, const unsigned* split_mask,
+                            int leaf_num, int inner_num) {
+  // Two 8-float halves per node, lanes 0 - 7 and 8 - 15.
+  const __m256i lane_bits[2] = {
+    _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128),
+    _mm256_setr_epi32(256, 512, 1024, 2048, 4096, 8192, 16384, 32768)
+  };
+  for (int i = 0; i < inner_num; ++i) {
+    __m256i mask = _mm256_set1_epi32(static_cast<int>(split_mask[i]));
+    for (int half = 0; half < 2; ++half) {
+      __m256 left = _mm256_loadu_ps(
+          node_alpha + left_id[i] * ALPHA_LANE_NUM + half * 8);
+      __m256 right = _mm256_loadu_ps(
+          node_alpha + right_id[i] * ALPHA_LANE_NUM + half * 8);
+      __m256 v_alpha = _mm256_add_ps(left, right);
+      __m256 h_alpha = _mm256_div_ps(_mm256_mul_ps(left, right), v_alpha);
+      __m256i split_bits = _mm256_and_si256(mask, lane_bits[half]);
+      __m256 is_v = _mm256_castsi256_ps(
+          _mm256_cmpeq_epi32(split_bits, lane_bits[half]));
+      _mm256_storeu_ps(node_alpha + (leaf_num + i) * ALPHA_LANE_NUM + half * 8,
+                       _mm256_blendv_ps(h_alpha, v_alpha, is_v));
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void RandomKernelAvx2(unsigned* random_state) {
+  for (int half = 0; half < 2; ++half) {
+    __m256i* state = reinterpret_cast<__m256i*>(random_state + half * 8);
+    __m256i x = _mm256_loadu_si256(state);
+    x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+    x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+    _mm256_storeu_si256(state, x);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void AlphaKernelAvx512(float* node_alpha, const int* left_id,
+                              const int* right_id, const unsigned* split_mask,
+                              int leaf_num, int inner_num) {
+  for (int i = 0; i < inner_num; ++i) {
+    __m512 left = _mm512_loadu_ps(node_alpha + left_id[i] * ALPHA_LANE_NUM);
+    __m512 right = _mm512_loadu_ps(node_alpha + right_id[i] * ALPHA_LANE_NUM);
+    __m512 v_alpha = _mm512_add_ps(left, right);
+    __m512 h_alpha = _mm512_div_ps(_mm512_mul_ps(left, right), v_alpha);
+    __m512 result = _mm512_mask_blend_ps(
+        static_cast<__mmask16>(split_mask[i]), h_alpha, v_alpha);
+    _mm512_storeu_ps(node_alpha + (leaf_num + i) * ALPHA_LANE_NUM, result);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void RandomKernelAvx512(unsigned* random_state) {
+  __m512i x = _mm512_loadu_si512(random_state);
+  x = _mm512_xor_si512(x, _mm512_maskz_slli_epi32(0xFFFF, x, 13));
+  x = _mm512_xor_si512(x, _mm512_maskz_srli_epi32(0xFFFF, x, 17));
+  x = _mm512_xor_si512(x, _mm512_maskz_slli_epi32(0xFFFF, x, 5));
+  _mm512_storeu_si512(random_state, x);
+}
+#endif
+
+// Collect the inner nodes level by level, and store them bottom-up so that the
+// children are always calculated before their parent.
+AlphaBatchEvaluator::AlphaBatchEvaluator(TreeNode* root,
+                                         const std::vector<TreeNode*>& leaves,
+                                         const std::vector<float>& image_alpha) {
+  leaves_ = leaves;
+  image_alpha_ = image_alpha;
+  int leaf_num = static_cast<int>(leaves_.size());
+  // Random leaf indices are taken from 16 random bits.
+  assert(leaf_num <= 65536);
+  std::map<TreeNode*, int> node_id;
+  for (int j = 0; j < leaf_num; ++j) node_id[leaves_[j]] = j;
+  std::vector<TreeNode*> level_order(1, root);
+  for (int i = 0; i < level_order.size(); ++i) {
+    if (level_order[i]->is_leaf_) continue;
+    inner_nodes_.push_back(level_order[i]);
+    level_order.push_back(level_order[i]->left_child_);
+    level_order.push_back(level_order[i]->right_child_);
+  }
+  std::reverse(inner_nodes_.begin(), inner_nodes_.end());
+  int inner_num = static_cast<int>(inner_nodes_.size());
+  for (int i = 0; i < inner_num; ++i) node_id[inner_nodes_[i]] = leaf_num + i;
+  for (int i = 0; i < inner_num; ++i) {
+    left_id_.push_back(node_id[inner_nodes_[i]->left_child_]);
+    right_id_.push_back(node_id[inner_nodes_[i]->right_child_]);
+  }
+  root_id_ = node_id[root];
+  split_mask_.assign(inner_num, 0);
+  node_alpha_.assign((leaf_num + inner_num) * ALPHA_LANE_NUM, 0);
+  // Every lane starts from the current image dispatch. The leaf rows of
+  // image_perm_ and node_alpha_ are shuffled in place afterwards.
+  for (int j = 0; j < leaf_num; ++j) {
+    for (int lane = 0; lane < ALPHA_LANE_NUM; ++lane) {
+      image_perm_.push_back(leaves_[j]->image_index_);
+      node_alpha_[j * ALPHA_LANE_NUM + lane] = leaves_[j]->alpha_;
+    }
+  }
+  // xorshift must not start from 0.
+  for (int lane = 0; lane < ALPHA_LANE_NUM; ++lane) {
+    random_state_.push_back(static_cast<unsigned>(rand()) * 2654435761u | 1);
+  }
+  alpha_kernel_ = AlphaKernelScalar;
+  random_kernel_ = RandomKernelScalar;
+#if defined(ALPHA_KERNEL_X86)
+  if (__builtin_cpu_supports("avx512f")) {
+    alpha_kernel_ = AlphaKernelAvx512;
+    random_kernel_ = RandomKernelAvx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    alpha_kernel_ = AlphaKernelAvx2;
+    random_kernel_ = RandomKernelAvx2;
+  }
+#endif
+}
+
+void AlphaBatchEvaluator::RandomCandidates() {
+  int leaf_num = static_cast<int>(leaves_.size());
+  unsigned* state = &random_state_[0];
+  // Fisher-Yates shuffle of the image dispatch, all the lanes at once. Leaf j
+  // of lane k is swapped with a random leaf in [0, j] of the same lane, the
+  // image index and the leaf aspect ratio together.
+  for (int j = leaf_num - 1; j > 0; --j) {
+    random_kernel_(state);
+    unsigned bound = j + 1;
+    int* perm_j = &image_perm_[j * ALPHA_LANE_NUM];
+    float* alpha_j = &node_alpha_[j * ALPHA_LANE_NUM];
+    for (int lane = 0; lane < ALPHA_LANE_NUM; ++lane) {
+      int k = ((state[lane] >> 16) * bound) >> 16;
+      std::swap(perm_j[lane], image_perm_[k * ALPHA_LANE_NUM + lane]);
+      std::swap(alpha_j[lane], node_alpha_[k * ALPHA_LANE_NUM + lane]);
+    }
+  }
+  // Each draw gives 32 random bits per lane, that is split masks (one bit per
+  // lane) for 32 inner nodes.
+  int inner_num = static_cast<int>(split_mask_.size());
+  for (int i = 0; i < inner_num; i += 2 * ALPHA_LANE_NUM) {
+    random_kernel_(state);
+    for (int lane = 0; lane < ALPHA_LANE_NUM; ++lane) {
+      if (i + 2 * lane < inner_num)
+        split_mask_[i + 2 * lane] = state[lane] & 0xFFFF;
+      if (i + 2 * lane + 1 < inner_num)
+        split_mask_[i + 2 * lane + 1] = state[lane] >> 16;
+    }
+  }
+}
+
+unsigned AlphaBatchEvaluator::Evaluate(float lower_bound, float upper_bound) {
+  int leaf_num = static_cast<int>(leaves_.size());
+  int inner_num = static_cast<int>(inner_nodes_.size());
+  if (inner_num > 0) {
+    alpha_kernel_(&node_alpha_[0], &left_id_[0], &right_id_[0],
+                  &split_mask_[0], leaf_num, inner_num);
+  }
+  unsigned pass_mask = 0;
+  for (int lane = 0; lane < ALPHA_LANE_NUM; ++lane) {
+    float root = root_alpha(lane);
+    if ((root >= lower_bound) && (root <= upper_bound)) pass_mask |= 1u << lane;
+  }
+  return pass_mask;
+}
+
+void AlphaBatchEvaluator::Materialize(int lane) {
+  assert((lane >= 0) && (lane < ALPHA_LANE_NUM));
+  int leaf_num = static_cast<int>(leaves_.size());
+  for (int i = 0; i < inner_nodes_.size(); ++i) {
+    inner_nodes_[i]->split_type_ = ((split_mask_[i] >> lane) & 1) ? 'v' : 'h';
+  }
+  for (int j = 0; j < leaf_num; ++j) {
+    int img_ind = image_perm_[j * ALPHA_LANE_NUM + lane];
+    leaves_[j]->image_index_ = img_ind;
+    leaves_[j]->alpha_ = image_alpha_[img_ind];
+  }
+}
+
 //void CollageBasic::AdjustAlpha(TreeNode *node, float thresh) {
 //  assert(thresh > 1);
 //  if (node->is_leaf_) return;
@@ -10,11 +10,14 @@
 #define wu_collage_basic_wu_collage_basic_h
 
 #include <opencv2/opencv.hpp>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <time.h>
 #define random(x) (rand() % x)
 #define MAX_TREE_GENE_NUM 10000  // Max number of tree re-generation.
+#define DEEP_ZOOM_TILE_SIZE 256  // Default edge length of deep-zoom tiles.
+#define ALPHA_LANE_NUM 16        // Candidates evaluated at once.
 
 class FloatRect {
 public:
@@ -57,6 +60,59 @@ public:
   TreeNode* parent_;
 };
 
+// Batch evaluation of the canvas aspect ratio for random candidates.
+// For a fixed tree shape, the root aspect ratio only depends on the split types
+// of inner nodes and the images dispatched to leaf nodes. We store the tree
+// bottom-up, level by level, in struct-of-arrays form (one float per node and
+// lane), so that ALPHA_LANE_NUM candidates are calculated in SIMD lanes at once.
+// Candidates are drawn the same way, with one xorshift generator per lane.
+// The AVX-512 / AVX2 / scalar kernels are chosen at runtime by the CPU.
+class AlphaBatchEvaluator {
+public:
+  AlphaBatchEvaluator(TreeNode* root, const std::vector<TreeNode*>& leaves,
+                      const std::vector<float>& image_alpha);
+  // Random split types and random image dispatch for all the lanes.
+  void RandomCandidates();
+  // Calculate root aspect ratio for all the lanes. The return value is a bit
+  // mask of the lanes whose aspect ratio is in [lower_bound, upper_bound].
+  unsigned Evaluate(float lower_bound, float upper_bound);
+  // Write split types and images of a candidate lane back into the tree.
+  void Materialize(int lane);
+  
+  float root_alpha(int lane) const {
+    return node_alpha_[root_id_ * ALPHA_LANE_NUM + lane];
+  }
+  
+private:
+  // Calculate inner node aspect ratios for all the lanes.
+  typedef void (*AlphaKernel)(float* node_alpha, const int* left_id,
+                              const int* right_id, const unsigned* split_mask,
+                              int leaf_num, int inner_num);
+  // Advance the xorshift state of all the lanes.
+  typedef void (*RandomKernel)(unsigned* random_state);
+  
+  // Inner nodes, bottom-up level order. Inner node i has node id leaf_num + i.
+  std::vector<TreeNode*> inner_nodes_;
+  // Leaf nodes, leaf j has node id j.
+  std::vector<TreeNode*> leaves_;
+  // Aspect ratios of input images.
+  std::vector<float> image_alpha_;
+  // Node ids of the children of inner nodes.
+  std::vector<int> left_id_;
+  std::vector<int> right_id_;
+  // For each inner node, bit k is set if lane k uses a 'v' cut.
+  std::vector<unsigned> split_mask_;
+  // Image index of leaf j in lane k is image_perm_[j * ALPHA_LANE_NUM + k].
+  std::vector<int> image_perm_;
+  // Aspect ratio of node id n in lane k is node_alpha_[n * ALPHA_LANE_NUM + k].
+  std::vector<float> node_alpha_;
+  // One xorshift32 state per lane.
+  std::vector<unsigned> random_state_;
+  int root_id_;
+  AlphaKernel alpha_kernel_;
+  RandomKernel random_kernel_;
+};
+
 // Collage with non-fixed aspect ratio
 class CollageBasic {
 public:
@@ -71,6 +127,9 @@ public:
     canvas_height_ = -1;
     image_num_ = static_cast<int>(image_vec_.size());
     tree_root_ = new TreeNode();
+    tile_index_cols_ = 0;
+    tile_index_rows_ = 0;
+    tile_size_ = DEEP_ZOOM_TILE_SIZE;
     srand(static_cast<unsigned>(time(0)));
   }
   CollageBasic(const std::vector<std::string> input_image_list, int canvas_width);
@@ -79,6 +138,8 @@ public:
     image_vec_.clear();
     image_alpha_vec_.clear();
     image_path_vec_.clear();
+    image_pyramid_vec_.clear();
+    tile_index_grid_.clear();
   }
   // Create collage.
   bool CreateCollage();
@@ -100,6 +161,40 @@ public:
   // Output collage into a html page.
   bool OutputCollageHtml (const std::string output_html_path);
   
+  // Output collage into a binary PPM image with shard_num local worker processes.
+  // The canvas is split along the top-level cuts of the tree, each subtree is
+  // described in a shard job file and rendered by a worker process, which
+  // writes its rows straight into the shared output file. No process holds the
+  // whole canvas in memory.
+  // Workers are started as "worker_path --shard <job_file>" (see main.cpp),
+  // by default worker_path is the running executable itself.
+  bool OutputCollageImageSharded(const std::string output_ppm_path,
+                                 int shard_num,
+                                 const std::string worker_path = "") const;
+  // Render the shard described by a shard job file into the shared output file.
+  // The job file only refers to image paths, so this can also be run by a
+  // separate process, e.g. "wu_collage_basic --shard <job_file>".
+  static bool RenderCollageShard(const std::string shard_job_path);
+  
+  // Deep-zoom output. Instead of rendering the whole canvas, single tiles of
+  // the image pyramid are rendered on demand. Level tile_max_level() is the
+  // full canvas size, and each lower level halves it (deep zoom convention).
+  // Only the images intersecting the requested tile are resized, using the
+  // smallest image pyramid level that still covers the needed resolution.
+  // Returns an empty cv::Mat if the tile is outside the level.
+  // Tile requests may run concurrently, but not together with CreateCollage().
+  cv::Mat OutputCollageTile(int level, int tile_col, int tile_row);
+  // Render one tile and save it where the viewer fetches it from:
+  // tiles_dir/level/tile_col_tile_row.jpg (tiles_dir is "<name>_files" for
+  // the descriptor "<name>.dzi").
+  bool OutputCollageTileFile(int level, int tile_col, int tile_row,
+                             const std::string tiles_dir);
+  // Output the deep-zoom descriptor (.dzi) for the viewer and set the tile
+  // size used by all the following tile requests. Tiles are not rendered
+  // here, call OutputCollageTileFile() when the viewer asks for them.
+  bool OutputCollageDzi(const std::string output_dzi_path,
+                        int tile_size = DEEP_ZOOM_TILE_SIZE);
+  
   // Accessors:
   int image_num() const {
     return image_num_;
@@ -113,6 +208,17 @@ public:
   float canvas_alpha() const {
     return canvas_alpha_;
   }
+  // Edge length of deep-zoom tiles, set by OutputCollageDzi().
+  int tile_size() const {
+    return tile_size_;
+  }
+  // Highest deep-zoom level, at which the tile pyramid has the canvas size.
+  int tile_max_level() const {
+    int max_side = std::max(canvas_width_, canvas_height_);
+    int level = 0;
+    while ((1 << level) < max_side) ++level;
+    return level;
+  }
   
 private:
   // Read input images from image list.
@@ -130,6 +236,19 @@ private:
   void RandomSplitType(TreeNode* node);
 //  // Top-down adjust aspect ratio for the final collage.
 //  void AdjustAlpha(TreeNode* node, float thresh);
+  // Split the canvas into (at most) shard_num subtrees. We keep cutting the
+  // largest subtree at its split, so the shards follow the tree cuts.
+  // regions gets the pixel region of each shard, they tile the canvas.
+  void SplitShards(int shard_num, std::vector<TreeNode*>* shards,
+                   std::vector<cv::Rect>* regions) const;
+  // Build a uniform grid over the positions of tree_leaves_. Each grid cell
+  // keeps the indices of the leaves which intersect with it.
+  void BuildTileIndex();
+  // Find the leaves (indices of tree_leaves_) intersecting with rect.
+  void QueryTileIndex(const FloatRect& rect, std::vector<int>* leaf_inds);
+  // Get the smallest pyramid level of an input image which is still not
+  // smaller than width x height. Pyramid levels are generated lazily.
+  cv::Mat PyramidImage(int img_ind, int width, int height);
   
   // Vector containing input image paths.
   std::vector<std::string> image_path_vec_;
@@ -149,6 +268,16 @@ private:
   float canvas_alpha_;
   // Canvas width, this is computed according to canvas_aspect_ratio_.
   int canvas_width_;
+  // Image pyramids (pyrDown) for input images, used by deep-zoom output.
+  std::vector<std::vector<cv::Mat> > image_pyramid_vec_;
+  // Grid index over tree_leaves_, built by BuildTileIndex().
+  std::vector<std::vector<int> > tile_index_grid_;
+  int tile_index_cols_;
+  int tile_index_rows_;
+  // Guards image_pyramid_vec_ and tile_index_grid_ for concurrent tiles.
+  std::mutex tile_cache_mutex_;
+  // Edge length of deep-zoom tiles, set by OutputCollageDzi().
+  int tile_size_;
   
 };
 